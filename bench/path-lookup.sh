@@ -0,0 +1,37 @@
+#!/bin/sh
+
+# Times external command lookup through a search path of deeply nested directories.
+# Only the last search directory holds the command, so every launch misses in the others first.
+# The search path is relative to the batch's working directory to keep the path line under CMD_CHAR_MAX.
+#
+# usage: bench/path-lookup.sh [witsh binary] [directory depth] [launches]
+
+WITSH=${1:-./Wits-Shell-Tester/witsshell}
+DEPTH=${2:-64}
+LAUNCHES=${3:-2000}
+NUM_DIRS=6
+
+BENCH_DIR=$(mktemp -d)
+trap 'rm -rf "$BENCH_DIR"' EXIT
+
+SEARCH_PATH=""
+for i in $(seq 1 $NUM_DIRS); do
+    DIR="$i"
+    for j in $(seq 1 $DEPTH); do DIR="$DIR/l"; done
+    mkdir -p "$BENCH_DIR/$DIR"
+    SEARCH_PATH="$SEARCH_PATH $DIR"
+done
+cp "$(which true)" "$BENCH_DIR/$DIR/bench-true"
+
+BATCH_FILE="$BENCH_DIR/batch.in"
+echo "cd $BENCH_DIR" > "$BATCH_FILE"
+echo "path$SEARCH_PATH" >> "$BATCH_FILE"
+for i in $(seq 1 $LAUNCHES); do echo "bench-true" >> "$BATCH_FILE"; done
+echo "exit" >> "$BATCH_FILE"
+
+START=$(date +%s%N)
+"$WITSH" "$BATCH_FILE" || exit 1
+END=$(date +%s%N)
+
+ELAPSED_US=$(( (END - START) / 1000 ))
+echo "$LAUNCHES launches, $NUM_DIRS search dirs $DEPTH levels deep: ${ELAPSED_US}us total, $(( ELAPSED_US / LAUNCHES ))us per launch"
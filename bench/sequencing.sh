@@ -0,0 +1,34 @@
+#!/bin/sh
+
+# Times conditional command chains run by witsh itself against the same chain wrapped in a nested sh,
+# which is what batch files had to do before witsh understood ';', '&&' and '||'.
+#
+# usage: bench/sequencing.sh [witsh binary] [lines]
+
+WITSH=${1:-./Wits-Shell-Tester/witsshell}
+LINES=${2:-1000}
+# Absolute paths so sh can't use its true/false builtins, both sides exec the same four programs
+CHAIN="/bin/true && /bin/false || /bin/true; /bin/true"
+
+BENCH_DIR=$(mktemp -d)
+trap 'rm -rf "$BENCH_DIR"' EXIT
+
+echo "$CHAIN" > "$BENCH_DIR/chain.sh"
+
+# time_batch name batch_line
+time_batch () {
+    BATCH_FILE="$BENCH_DIR/$1.in"
+    echo "path /bin" > "$BATCH_FILE"
+    for i in $(seq 1 $LINES); do echo "$2" >> "$BATCH_FILE"; done
+    echo "exit" >> "$BATCH_FILE"
+
+    START=$(date +%s%N)
+    "$WITSH" "$BATCH_FILE" || exit 1
+    END=$(date +%s%N)
+
+    ELAPSED_US=$(( (END - START) / 1000 ))
+    echo "$1: $LINES lines of '$CHAIN': ${ELAPSED_US}us total, $(( ELAPSED_US / LINES ))us per line"
+}
+
+time_batch witsh "$CHAIN"
+time_batch sh "sh $BENCH_DIR/chain.sh"
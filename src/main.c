@@ -1,3 +1,5 @@
+#define _GNU_SOURCE // O_PATH
+
 #include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -6,19 +8,49 @@
 #include <string.h>
 #include <sys/errno.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
 
 #define DEFAULT_PATH "/bin/"
 #define DEFAULT_PATH_COUNT 1
 
+// Search directories are only ever used as *at() anchors, O_PATH skips the permission checks of a real open
+#ifdef __linux__
+#define SEARCH_PATH_OPEN_FLAGS (O_PATH | O_DIRECTORY | O_CLOEXEC)
+#else
+#define SEARCH_PATH_OPEN_FLAGS (O_RDONLY | O_DIRECTORY | O_CLOEXEC)
+#endif
+
 #define CMD_CHAR_MAX 1024
 
 #define PARALLEL_TOKEN '&'
+#define SEQUENCE_TOKEN ';'
+#define OR_TOKEN '|' // doubled, a single '|' is just part of a word
 #define REDIRECT_TOKEN '>'
+#define INPUT_REDIRECT_TOKEN '<'
+#define STDERR_REDIRECT_TOKEN '2'
 #define SEPERATOR_CHAR ' '
+#define GLOB_CHARS "*?["
+#define VAR_TOKEN '$'
+#define STATUS_VAR_TOKEN '?'
+#define ASSIGN_TOKEN '='
+
+#define INTERN_INITIAL_CAPACITY 256 // must be a power of two
+
+#define GLOB_DENTS_BUF_SIZE (1 << 17) // 128KiB per getdents64 call, avoids a syscall per handful of entries
 
 #define EXIT_CMD "exit"
 #define CD_CMD "cd"
 #define PATH_CMD "path"
+#define EXPORT_CMD "export"
 
 #define PRINT_ERROR fputs("An error has occurred\n", stderr);
 
@@ -36,36 +68,170 @@
  *      [x] exit - call exit() 
  *      [x] cd - change the directory with chdir()
  *      [x] path - overwrite the search directory by the specified args
+ *      [x] export - mark variables to be passed into the environment of external commands
  * [x] External commands
+ *      [x] names containing '/' run that file directly, e.g. /bin/ls or ./run, whatever the path is
  * [x] Output Redirection - Move the ouput into a specified file, if it doesn't exist then create it
+ *      [x] '<' stdin, '>' / '>>' stdout, '2>' / '2>>' stderr, '&>' / '&>>' stdout and stderr
+ *      [x] '2>&1' / '>&2' - point one stream at another
  * [x] Parallel Execution - Move the cmd into the background
+ * [x] Command lists - ';' runs in sequence, '&&' / '||' short circuit on the exit status, '&' binds loosest
  * [p] Error handling - Write "An error has occurred\n" into stderr
+ * [x] Glob expansion - Expand '*', '?' and '[...]' in arguments into matching paths
+ * [x] Variables - NAME=value assignment, $NAME / ${NAME} / $? expansion and NAME=value cmd overrides
  */
 
+typedef enum {
+    LIST_OP_END,
+    LIST_OP_SEQUENCE, // ;
+    LIST_OP_PARALLEL, // &
+    LIST_OP_AND, // &&
+    LIST_OP_OR // ||
+} list_op_t;
+
+typedef struct {
+    char* cmdline; // only tokenized right before it runs, so it sees what earlier commands changed
+    list_op_t op; // operator following the command
+} list_item_t;
+
+typedef struct {
+    int target_fd; // fd the command sees the redirect on
+    int open_flags;
+    char* file; // NULL duplicates source_fd onto target_fd instead of opening anything
+    int source_fd; // opened by the parent just before the fork
+} redirect_t;
+
 typedef struct {
     char** argv;
     size_t argc;
-    char* redirect_file;
+    redirect_t* redirects; // applied in order
+    size_t num_redirects;
+    char** assigns; // leading NAME=value tokens, applied to the command's environment only
+    size_t num_assigns;
 } cmd_t;
 
+// Growable, NULL terminated array of owned strings - used to build argv
+typedef struct {
+    char** items;
+    size_t count;
+    size_t capacity;
+} strvec_t;
+
+typedef struct {
+    size_t name_offset; // offset into dir_listing_t.names
+    unsigned char type; // DT_* value reported by the directory read
+} dir_entry_t;
+
+// A single scanned directory, entries sorted by name
+typedef struct {
+    char* path;
+    char* names; // packed, NUL separated entry names
+    size_t names_len;
+    size_t names_capacity;
+    dir_entry_t* entries;
+    size_t num_entries;
+} dir_listing_t;
+
+// Chained so superseded values can be unlinked and freed as soon as no variable holds them
+typedef struct intern_entry {
+    struct intern_entry* next;
+    size_t refs; // variables holding the string
+    char string[];
+} intern_entry_t;
+
+typedef struct {
+    const char* entry; // interned "NAME=value", handed to execve as is
+    size_t name_len;
+    bool exported;
+} var_t;
+
 void mode_interactive(void);
 void mode_batch(const char* batch_filepath);
 
 bool is_incmd(cmd_t* cmd);
 void strip_extra_spaces(char* string);
 
+bool tokenize_cmdline(char* cmdline, cmd_t* cmd);
+void add_word(const char* word, strvec_t* argv, strvec_t* assigns);
+size_t parse_redirect_op(const char* cursor, int* target_fd, int* open_flags, bool* is_both, bool* is_dup);
+void free_cmd(cmd_t* cmd);
+
+bool open_redirects(cmd_t* cmd);
+void apply_redirects(cmd_t* cmd);
+void close_redirects(cmd_t* cmd);
+
+void strvec_push(strvec_t* vec, char* item);
+
+void expand_glob(const char* pattern, strvec_t* out);
+void glob_walk(char* path, size_t path_len, const char* rest, bool check_exists, strvec_t* out);
+dir_listing_t* dir_cache_lookup(const char* dir_path);
+void dir_listing_add(dir_listing_t* listing, const char* name, unsigned char type);
+void dir_cache_clear(void);
+
+uint64_t hash_string(const char* string, size_t len);
+const char* intern_string(const char* string, size_t len);
+void release_string(const char* string);
+void load_environment(char** envp);
+var_t* find_var(const char* name, size_t name_len);
+const char* get_var(const char* name, size_t name_len);
+void set_var(const char* assignment, bool export);
+char** get_env_block(void);
+bool is_assignment(const char* token);
+char* expand_vars(const char* token);
+
+void set_search_path_fds(void);
+void exec_from_search_path(size_t path_idx, cmd_t* cmd);
+
+bool split_cmd_list(char* cmdline, list_item_t** items, size_t* num_items);
+int run_and_or(list_item_t* items, size_t start, size_t end);
+pid_t launch_and_or(list_item_t* items, size_t start, size_t end);
+pid_t start_cmd(char* cmdline, int* status);
+int run_cmd(char* cmdline);
+int wait_status(pid_t pid);
+void exit_child(int status);
+
 void handle_line(char* cmdline_buffer);
 void handle_excmd(cmd_t* cmd); // External commands i.e. programs
-void handle_incmd(cmd_t* cmd); // Internal commands
+int handle_incmd(cmd_t* cmd); // Internal commands
+int handle_incmd_redirected(cmd_t* cmd);
 
 // GLOBAL VARIABLES - NO TOUCHY
 char** search_paths;
 size_t num_search_paths;
+int* search_path_fds = NULL; // one per search path, -1 if the directory couldn't be opened
+size_t num_search_paths_fds = 0;
+
+// Set in a forked copy of the shell running a backgrounded and-or list
+bool is_subshell = false;
+
+// Exit status of the last foreground command, expanded by $?
+int last_status = EXIT_SUCCESS;
+
+// Directory listings scanned while expanding globs, only valid until the next command finishes
+dir_listing_t** dir_cache = NULL; // each listing is allocated on its own so pointers survive the cache growing
+size_t num_dir_cache = 0;
+
+// Every variable string lives exactly once in the intern table, so equal strings are equal pointers
+intern_entry_t** intern_table = NULL;
+size_t intern_capacity = 0;
+size_t intern_count = 0;
+
+var_t* shell_vars = NULL;
+size_t num_shell_vars = 0;
+
+// envp handed to execve, only rebuilt after an exported variable changes
+char** env_block = NULL;
+bool env_block_dirty = true;
+
+extern char** environ;
 
 int main(int argc, char* argv[]) {
     search_paths = malloc(1 * sizeof(char*)); // Only one initial path entry
     search_paths[0] = DEFAULT_PATH;
     num_search_paths = DEFAULT_PATH_COUNT;
+    set_search_path_fds();
+
+    load_environment(environ);
 
     if (argc == 1) {
         mode_interactive();
@@ -135,152 +301,644 @@ void handle_line(char* cmdline_buffer) {
     if (cmdline_buffer[0] == PARALLEL_TOKEN && strlen(cmdline_buffer) == 1) {
         return;
     } // If only the Parallel Token is input, then just exit without an error
-    if (cmdline_buffer[strlen(cmdline_buffer) - 1] == '&') {
-        cmdline_buffer[strlen(cmdline_buffer) - 1] = '\0';
-    }
 
-    // Parallel Command Split
-    char** parallel_cmdlines = NULL;
-    char* current_cmd;
-    size_t num_parallel_cmds = 1, parallel_cmd_idx = 0;
-    
-    for (size_t i = 0; i < strlen(cmdline_buffer) - 1; ++i) {
-        if (cmdline_buffer[i] == PARALLEL_TOKEN) { ++num_parallel_cmds; }
+    list_item_t* items;
+    size_t num_items;
+    if (!split_cmd_list(cmdline_buffer, &items, &num_items)) {
+        PRINT_ERROR;
+        return;
     }
 
-    parallel_cmdlines = malloc(num_parallel_cmds * sizeof(char*));
-    
-    while ((current_cmd = strsep(&cmdline_buffer, "&")) != NULL) {
-        parallel_cmdlines[parallel_cmd_idx] = current_cmd;
-        ++parallel_cmd_idx;
+    /** Error Handling - Parallel Commands
+     *
+     *  - ERORR CAUSE - EXPECTED OUTPUT
+     *  - Only Parallel Command token found - no error - just return
+     *  - Parallel Token at end of single command - Just ignore last token
+     *  - No whitespace between parallel token and command - split into seperate commands 
+     */
+
+    // '&' and ';' end an and-or list, so "a && b & c" runs "a && b" in the background next to "c"
+    pid_t* child_pids = (pid_t*) malloc(num_items * sizeof(pid_t));
+    size_t num_child_pids = 0;
+
+    for (size_t start = 0; start < num_items;) {
+        size_t end = start;
+        while (items[end].op == LIST_OP_AND || items[end].op == LIST_OP_OR) { ++end; }
+
+        if (items[end].op == LIST_OP_PARALLEL) {
+            int status;
+            pid_t child_pid = start == end ? start_cmd(items[start].cmdline, &status) : launch_and_or(items, start, end);
+            if (child_pid != -1) {
+                child_pids[num_child_pids++] = child_pid;
+            }
+        } else {
+            run_and_or(items, start, end);
+        }
+
+        start = end + 1;
     }
 
-    // Command token split
-    cmd_t* parallel_cmds = malloc(num_parallel_cmds * sizeof(cmd_t));
-    for (size_t i = 0; i < num_parallel_cmds; ++i) {
-        char** tokens = NULL;
-        char* current_cmdline;
-        char* current_token;
-        char* redirect_file = NULL;
-        size_t num_tokens = 1, token_idx = 0;
+    for (size_t i = 0; i < num_child_pids; ++i) {
+        waitpid(child_pids[i], NULL, 0);
+    }
 
-        strip_extra_spaces(parallel_cmdlines[i]);
+    dir_cache_clear();
+    free(items);
+    free(child_pids);
+}
 
-        current_cmdline = parallel_cmdlines[i];
-        if (strchr(parallel_cmdlines[i], REDIRECT_TOKEN) != NULL) {
-            current_cmdline = strsep(&parallel_cmdlines[i], ">");
-            redirect_file = strsep(&parallel_cmdlines[i], ">");
+// Split a line on ';', '&', '&&' and '||' in place, "&>" and ">&" stay redirects
+// Returns false if '&&' or '||' is missing a command on either side
+bool split_cmd_list(char* cmdline, list_item_t** items, size_t* num_items) {
+    size_t items_capacity = 4;
+
+    *num_items = 0;
+    *items = malloc(items_capacity * sizeof(list_item_t));
+    (*items)[0].cmdline = cmdline;
+
+    for (char* cursor = cmdline; ; ++cursor) {
+        list_op_t op;
+        size_t op_len = 1;
+
+        if (*cursor == '\0') {
+            op = LIST_OP_END;
+        } else if (cursor[0] == PARALLEL_TOKEN && cursor[1] == PARALLEL_TOKEN) {
+            op = LIST_OP_AND;
+            op_len = 2;
+        } else if (cursor[0] == OR_TOKEN && cursor[1] == OR_TOKEN) {
+            op = LIST_OP_OR;
+            op_len = 2;
+        } else if (cursor[0] == PARALLEL_TOKEN && cursor > cmdline && cursor[-1] == REDIRECT_TOKEN) {
+            continue; // ">&" duplicates a stream, it isn't a parallel token
+        } else if (cursor[0] == PARALLEL_TOKEN && cursor[1] != REDIRECT_TOKEN) {
+            op = LIST_OP_PARALLEL;
+        } else if (cursor[0] == SEQUENCE_TOKEN) {
+            op = LIST_OP_SEQUENCE;
+        } else {
+            continue;
+        }
 
-            // If no command is specified before the redirect
-            if (strlen(current_cmdline) == 0) {
-                PRINT_ERROR;
-                return;
-            }
+        (*items)[(*num_items)++].op = op;
+        if (op == LIST_OP_END) { break; }
 
-            strip_extra_spaces(current_cmdline);
-            strip_extra_spaces(redirect_file);
+        *cursor = '\0';
+        cursor += op_len - 1;
 
+        if (*num_items == items_capacity) {
+            items_capacity *= 2;
+            *items = realloc(*items, items_capacity * sizeof(list_item_t));
+        }
+        (*items)[*num_items].cmdline = cursor + 1;
+    }
 
-            // If anymore redirect tokens are found then throw an error
-            // Or if there are more than one specified output files
-            if (strsep(&parallel_cmdlines[i], ">") != NULL || strchr(redirect_file, SEPERATOR_CHAR) != NULL) {
-                PRINT_ERROR;
-                return;
-            }
+    // Empty commands are fine around ';' and '&', but "&& b" or "a ||" has nothing to short circuit
+    for (size_t i = 0; i < *num_items; ++i) {
+        bool is_empty = (*items)[i].cmdline[strspn((*items)[i].cmdline, " ")] == '\0';
+        bool is_conditional = (*items)[i].op == LIST_OP_AND || (*items)[i].op == LIST_OP_OR ||
+                (i > 0 && ((*items)[i - 1].op == LIST_OP_AND || (*items)[i - 1].op == LIST_OP_OR));
 
+        if (is_empty && is_conditional) {
+            free(*items);
+            return false;
         }
+    }
+
+    return true;
+}
 
-        for (size_t j = 0; j < strlen(current_cmdline) - 1; ++j) { 
-            if (current_cmdline[j] == SEPERATOR_CHAR) { ++num_tokens; }
+// Run items[start..end] left to right, "a || b && c" is "(a || b) && c"
+int run_and_or(list_item_t* items, size_t start, size_t end) {
+    int status = run_cmd(items[start].cmdline);
+
+    for (size_t i = start + 1; i <= end; ++i) {
+        if ((items[i - 1].op == LIST_OP_AND) == (status == EXIT_SUCCESS)) {
+            status = run_cmd(items[i].cmdline);
         }
+    }
 
-        tokens = malloc(num_tokens * sizeof(char*));
-        while ((current_token = strsep(&current_cmdline, " ")) != NULL) {
-            tokens[token_idx] = current_token; 
-            ++token_idx;
+    return status;
+}
+
+// A backgrounded and-or list runs in a forked copy of the shell, no other shell is exec'd
+pid_t launch_and_or(list_item_t* items, size_t start, size_t end) {
+    fflush(stdout);
+
+    pid_t fork_result = fork();
+    if (fork_result == 0) {
+        is_subshell = true;
+        exit_child(run_and_or(items, start, end));
+    }
+    return fork_result;
+}
+
+// Tokenizes and starts a single command. External commands are forked and their pid returned,
+// builtins and malformed commands finish here and return -1 with their status set
+pid_t start_cmd(char* cmdline, int* status) {
+    cmd_t cmd;
+    pid_t fork_result = -1;
+
+    *status = EXIT_FAILURE;
+    if (!tokenize_cmdline(cmdline, &cmd)) {
+        PRINT_ERROR;
+        free_cmd(&cmd);
+        return -1;
+    }
+
+    // Redirect files are opened here so a failed open never costs a fork
+    if (!open_redirects(&cmd)) {
+        PRINT_ERROR;
+        free_cmd(&cmd);
+        return -1;
+    }
+
+    if (!is_incmd(&cmd)) {
+        fork_result = fork();
+
+        if (fork_result == 0) {
+            handle_excmd(&cmd);
+            exit_child(EXIT_FAILURE); // only reached if the exec failed
         }
+    } else {
+        *status = handle_incmd_redirected(&cmd);
+    }
+
+    close_redirects(&cmd);
+    free_cmd(&cmd);
+    return fork_result;
+}
 
-        parallel_cmds[i].argv = tokens;
-        parallel_cmds[i].argc = num_tokens;
-        parallel_cmds[i].redirect_file = redirect_file;
+int run_cmd(char* cmdline) {
+    int status;
+    pid_t child_pid = start_cmd(cmdline, &status);
 
+    if (child_pid != -1) {
+        status = wait_status(child_pid);
     }
-    free(parallel_cmdlines);
 
-    /** Error Handling - Parallel Commands
-     *
-     *  - ERORR CAUSE - EXPECTED OUTPUT
-     *  - Only Parallel Command token found - no error - just return
-     *  - Parallel Token at end of single command - Just ignore last token
-     *  - No whitespace between parallel token and command - split into seperate commands 
-     */
+    // The command may have changed what later globs match
+    dir_cache_clear();
 
-    pid_t* child_pids = (pid_t*) malloc(num_parallel_cmds * sizeof(pid_t));
-    for (size_t i = 0; i < num_parallel_cmds; ++i) {
-        if (!is_incmd(&parallel_cmds[i])) {
-            pid_t fork_result = fork();
+    last_status = status;
+    return status;
+}
+
+// Forked children share the batch file's offset with the shell, and exit() would seek it back
+// to where stdio had buffered up to at fork time, replaying lines the shell already read
+void exit_child(int status) {
+    fflush(stdout);
+    fflush(stderr);
+    _exit(status);
+}
+
+int wait_status(pid_t pid) {
+    int wait_result;
+
+    if (waitpid(pid, &wait_result, 0) == -1) { return EXIT_FAILURE; }
+    if (WIFSIGNALED(wait_result)) { return 128 + WTERMSIG(wait_result); }
+    return WEXITSTATUS(wait_result);
+}
 
-            if (fork_result == 0) {
-                handle_excmd(&parallel_cmds[i]);
-                exit(EXIT_SUCCESS); // don't execute the rest of the loop iterations if it is a child
+/** Error Handling - Redirection
+ *
+ *  - ERORR CAUSE - EXPECTED OUTPUT
+ *  - Multiple Output files - stderr write "An error has occurred"
+ *  - Multiple redirects of the same stream - stderr write "An error has occurred"
+ *  - No command before redirect token - stderr write "An error has occurred"
+ *  - No file after redirect token - stderr write "An error has occurred"
+ */
+
+// Split a command into argv and its redirects, expanding variables and then any glob tokens
+// argv is always NULL terminated so it can be handed straight to exec
+// Returns false if the command is malformed, cmd is still safe to free
+bool tokenize_cmdline(char* cmdline, cmd_t* cmd) {
+    strvec_t argv = { NULL, 0, 0 };
+    strvec_t assigns = { NULL, 0, 0 };
+    char* cursor = cmdline;
+    bool is_valid = true;
+    int redirected_fds = 0; // bit per target fd, each stream may only be redirected once
+
+    cmd->redirects = NULL;
+    cmd->num_redirects = 0;
+
+    while (is_valid) {
+        while (*cursor == SEPERATOR_CHAR) { ++cursor; }
+        if (*cursor == '\0') { break; }
+
+        int target_fd, open_flags;
+        bool is_both, is_dup;
+        size_t op_len = parse_redirect_op(cursor, &target_fd, &open_flags, &is_both, &is_dup);
+
+        // Words run until a space or the start of a redirect, so "ls>out" splits the same as "ls > out"
+        const char* word = cursor + op_len;
+        while (*word == SEPERATOR_CHAR) { ++word; }
+
+        size_t word_len = 0;
+        while (word[word_len] != '\0' && word[word_len] != SEPERATOR_CHAR &&
+                word[word_len] != REDIRECT_TOKEN && word[word_len] != INPUT_REDIRECT_TOKEN &&
+                !(word[word_len] == PARALLEL_TOKEN && word[word_len + 1] == REDIRECT_TOKEN)) {
+            ++word_len;
+        }
+
+        char* word_copy = strndup(word, word_len);
+        cursor = (char*) word + word_len;
+
+        if (op_len == 0) {
+            // Only redirects may follow a redirect
+            if (cmd->num_redirects > 0) { is_valid = false; }
+            else { add_word(word_copy, &argv, &assigns); }
+
+            free(word_copy);
+            continue;
+        }
+
+        int stream_bits = (1 << target_fd) | (is_both ? 1 << STDERR_FILENO : 0);
+        if (word_len == 0 || (redirected_fds & stream_bits) != 0) {
+            is_valid = false;
+            free(word_copy);
+            continue;
+        }
+        redirected_fds |= stream_bits;
+
+        // "N>&M" points N at whatever M is at that point, only the standard streams can be named
+        if (is_dup) {
+            if (word_len != 1 || word[0] < '0' || word[0] > '0' + STDERR_FILENO) {
+                is_valid = false;
             } else {
-                child_pids[i] = fork_result;
+                cmd->redirects = realloc(cmd->redirects, (cmd->num_redirects + 1) * sizeof(redirect_t));
+                cmd->redirects[cmd->num_redirects++] = (redirect_t) { target_fd, 0, NULL, word[0] - '0' };
             }
-        } else {
-            handle_incmd(&parallel_cmds[i]);
+
+            free(word_copy);
+            continue;
+        }
+
+        cmd->redirects = realloc(cmd->redirects, (cmd->num_redirects + 2) * sizeof(redirect_t));
+        cmd->redirects[cmd->num_redirects++] = (redirect_t) { target_fd, open_flags, expand_vars(word_copy), -1 };
+        if (is_both) {
+            cmd->redirects[cmd->num_redirects++] = (redirect_t) { STDERR_FILENO, 0, NULL, STDOUT_FILENO };
         }
+        free(word_copy);
     }
 
-    for (size_t i = 0; i < num_parallel_cmds; ++i) {
-        waitpid(child_pids[i], NULL, 0);
+    if (argv.items == NULL) { argv.items = calloc(1, sizeof(char*)); }
+
+    cmd->argv = argv.items;
+    cmd->argc = argv.count;
+    cmd->assigns = assigns.items;
+    cmd->num_assigns = assigns.count;
+
+    // If no command is specified before the redirect
+    if (cmd->num_redirects > 0 && cmd->argc == 0) { is_valid = false; }
+
+    return is_valid;
+}
+
+void add_word(const char* word, strvec_t* argv, strvec_t* assigns) {
+    char* expanded_word = expand_vars(word);
+
+    // A word that only held unset or empty variables disappears, the same as sh
+    if (expanded_word[0] == '\0' && word[0] != '\0') {
+        free(expanded_word);
+        return;
     }
 
-    free(parallel_cmds);
-    free(child_pids);
+    if (argv->count == 0 && is_assignment(word)) {
+        strvec_push(assigns, expanded_word);
+    } else if (strpbrk(expanded_word, GLOB_CHARS) != NULL) {
+        expand_glob(expanded_word, argv);
+        free(expanded_word);
+    } else {
+        strvec_push(argv, expanded_word);
+    }
 }
 
+// Returns the length of the redirect operator at cursor, 0 if there isn't one
+size_t parse_redirect_op(const char* cursor, int* target_fd, int* open_flags, bool* is_both, bool* is_dup) {
+    size_t op_len = 0;
 
-void handle_excmd(cmd_t* cmd) {
-    
-    // To handle redirects, change stdout to the relevant file to output to that
-    // file and then remove the two tokens from cmd->argv and any that occur afterwards
-    
-    /** Error Handling - Redirection
-     *
-     *  - ERORR CAUSE - EXPECTED OUTPUT
-     *  - Multiple Output files - stderr write "An error has occurred"
-     *  - Multiple redirect tokens - stderr write "An error has occurred"
-     *  - No command before redirect token - stderr write "An error has occurred"
-     *
-     */
+    *is_both = false;
+    *is_dup = false;
+    *target_fd = STDOUT_FILENO;
 
-    int saved_stdout = dup(fileno(stdout));
+    if (cursor[0] == INPUT_REDIRECT_TOKEN) {
+        *target_fd = STDIN_FILENO;
+        *open_flags = O_RDONLY;
+        return 1;
+    }
 
-    if (cmd->redirect_file != NULL) {
-        FILE* output_file = fopen(cmd->redirect_file, "w"); 
-        if (output_file == NULL) {
-            PRINT_ERROR;
-            return;
+    if (cursor[0] == PARALLEL_TOKEN && cursor[1] == REDIRECT_TOKEN) {
+        *is_both = true;
+        op_len = 1;
+    } else if (cursor[0] == STDERR_REDIRECT_TOKEN && cursor[1] == REDIRECT_TOKEN) {
+        // Only reached at the start of a word, so "ls2>out" is still "ls2" > "out"
+        *target_fd = STDERR_FILENO;
+        op_len = 1;
+    }
+
+    if (cursor[op_len] != REDIRECT_TOKEN) { return 0; }
+    ++op_len;
+
+    if (cursor[op_len] == PARALLEL_TOKEN && !*is_both) {
+        *is_dup = true;
+        return op_len + 1;
+    }
+
+    // O_APPEND makes every write land at the end, so concurrent appenders never overwrite each other
+    if (cursor[op_len] == REDIRECT_TOKEN) {
+        *open_flags = O_WRONLY | O_CREAT | O_APPEND;
+        ++op_len;
+    } else {
+        *open_flags = O_WRONLY | O_CREAT | O_TRUNC;
+    }
+
+    return op_len;
+}
+
+void free_cmd(cmd_t* cmd) {
+    for (size_t i = 0; i < cmd->argc; ++i) {
+        free(cmd->argv[i]);
+    }
+    for (size_t i = 0; i < cmd->num_assigns; ++i) {
+        free(cmd->assigns[i]);
+    }
+    for (size_t i = 0; i < cmd->num_redirects; ++i) {
+        free(cmd->redirects[i].file);
+    }
+    free(cmd->argv);
+    free(cmd->assigns);
+    free(cmd->redirects);
+}
+
+// Opened with O_CLOEXEC so parallel siblings never inherit each other's files,
+// dup2 clears the flag on the copy the command actually uses
+bool open_redirects(cmd_t* cmd) {
+    for (size_t i = 0; i < cmd->num_redirects; ++i) {
+        if (cmd->redirects[i].file == NULL) { continue; }
+
+        cmd->redirects[i].source_fd = open(cmd->redirects[i].file, cmd->redirects[i].open_flags | O_CLOEXEC, 0666);
+        if (cmd->redirects[i].source_fd == -1) {
+            close_redirects(cmd);
+            return false;
+        }
+    }
+    return true;
+}
+
+void apply_redirects(cmd_t* cmd) {
+    for (size_t i = 0; i < cmd->num_redirects; ++i) {
+        dup2(cmd->redirects[i].source_fd, cmd->redirects[i].target_fd);
+    }
+}
+
+void close_redirects(cmd_t* cmd) {
+    for (size_t i = 0; i < cmd->num_redirects; ++i) {
+        if (cmd->redirects[i].file != NULL && cmd->redirects[i].source_fd != -1) {
+            close(cmd->redirects[i].source_fd);
+            cmd->redirects[i].source_fd = -1;
+        }
+    }
+}
+
+void strvec_push(strvec_t* vec, char* item) {
+    // Keep room for the NULL terminator
+    if (vec->count + 1 >= vec->capacity) {
+        vec->capacity = vec->capacity == 0 ? 8 : vec->capacity * 2;
+        vec->items = realloc(vec->items, vec->capacity * sizeof(char*));
+    }
+
+    vec->items[vec->count++] = item;
+    vec->items[vec->count] = NULL;
+}
+
+/**
+ * Glob expansion
+ *
+ * Patterns are matched one path component at a time so "logs/[0-9]?/err*.log" only lists
+ * the directories it needs. Matches come out sorted and a pattern matching nothing is
+ * passed through unchanged, the same as sh. The results are heap allocated, so the
+ * expansion is only bounded by memory and not by CMD_CHAR_MAX.
+ */
+void expand_glob(const char* pattern, strvec_t* out) {
+    char path[PATH_MAX];
+    size_t path_len = 0;
+    size_t num_before = out->count;
+
+    if (pattern[0] == '/') {
+        path[path_len++] = '/';
+    }
+    path[path_len] = '\0';
+
+    glob_walk(path, path_len, pattern + path_len, false, out);
+
+    if (out->count == num_before) {
+        strvec_push(out, strdup(pattern));
+    }
+}
+
+// path holds the components matched so far (with a trailing '/'), rest is what is left of the pattern
+void glob_walk(char* path, size_t path_len, const char* rest, bool check_exists, strvec_t* out) {
+    // Collapse repeated slashes
+    while (rest[0] == '/') { ++rest; }
+
+    if (rest[0] == '\0') {
+        // Literal components after a glob still have to exist to count as a match
+        if (check_exists) {
+            struct stat st;
+            if (lstat(path, &st) != 0) { return; }
+        }
+        strvec_push(out, strdup(path));
+        return;
+    }
+
+    size_t component_len = strcspn(rest, "/");
+    bool is_last = rest[component_len] == '\0';
+    char component[NAME_MAX + 1];
+
+    if (component_len > NAME_MAX) { return; }
+    memcpy(component, rest, component_len);
+    component[component_len] = '\0';
+
+    if (strpbrk(component, GLOB_CHARS) == NULL) {
+        if (path_len + component_len + 1 >= PATH_MAX) { return; }
+
+        memcpy(path + path_len, rest, component_len + !is_last); // keep the '/'
+        path[path_len + component_len + !is_last] = '\0';
+        glob_walk(path, path_len + component_len + !is_last, rest + component_len, true, out);
+        path[path_len] = '\0';
+        return;
+    }
+
+    dir_listing_t* listing = dir_cache_lookup(path_len == 0 ? "." : path);
+    for (size_t i = 0; i < listing->num_entries; ++i) {
+        const char* name = listing->names + listing->entries[i].name_offset;
+        size_t name_len = strlen(name);
+
+        if (fnmatch(component, name, FNM_PERIOD) != 0) { continue; }
+        if (path_len + name_len + 1 >= PATH_MAX) { continue; }
+
+        memcpy(path + path_len, name, name_len);
+        path[path_len + name_len] = '\0';
+
+        if (is_last) {
+            strvec_push(out, strdup(path));
+        } else {
+            // Only descend into directories, d_type saves a stat for most entries
+            unsigned char type = listing->entries[i].type;
+            if (type == DT_LNK || type == DT_UNKNOWN) {
+                struct stat st;
+                type = (stat(path, &st) == 0 && S_ISDIR(st.st_mode)) ? DT_DIR : DT_REG;
+            }
+
+            if (type == DT_DIR) {
+                path[path_len + name_len] = '/';
+                path[path_len + name_len + 1] = '\0';
+                glob_walk(path, path_len + name_len + 1, rest + component_len, false, out);
+            }
+        }
+    }
+    path[path_len] = '\0';
+}
+
+#ifdef __linux__
+// The kernel's record layout for getdents64, glibc only exposes it with _GNU_SOURCE
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+#endif
+
+char* sort_names; // qsort has no context argument in C11
+int dir_entry_name_compare(const void* a, const void* b) {
+    return strcmp(sort_names + ((const dir_entry_t*) a)->name_offset,
+                  sort_names + ((const dir_entry_t*) b)->name_offset);
+}
+
+// Read a directory once per line, all further globs over it are served from the cache
+dir_listing_t* dir_cache_lookup(const char* dir_path) {
+    for (size_t i = 0; i < num_dir_cache; ++i) {
+        if (strcmp(dir_cache[i]->path, dir_path) == 0) {
+            return dir_cache[i];
+        }
+    }
+
+    dir_listing_t* listing = malloc(sizeof(dir_listing_t));
+    dir_cache = realloc(dir_cache, (num_dir_cache + 1) * sizeof(dir_listing_t*));
+    dir_cache[num_dir_cache++] = listing;
+    listing->path = strdup(dir_path);
+    listing->names = NULL;
+    listing->names_len = 0;
+    listing->names_capacity = 0;
+    listing->entries = NULL;
+    listing->num_entries = 0;
+
+    // Unreadable directories are cached as empty so they aren't retried
+    int dir_fd = open(dir_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd == -1) { return listing; }
+
+#ifdef __linux__
+    char* dents_buffer = malloc(GLOB_DENTS_BUF_SIZE);
+    long num_read;
+
+    while ((num_read = syscall(SYS_getdents64, dir_fd, dents_buffer, GLOB_DENTS_BUF_SIZE)) > 0) {
+        for (long offset = 0; offset < num_read;) {
+            struct linux_dirent64* dent = (struct linux_dirent64*) (dents_buffer + offset);
+            offset += dent->d_reclen;
+            dir_listing_add(listing, dent->d_name, dent->d_type);
         }
-        dup2(fileno(output_file), fileno(stdout));
     }
 
+    free(dents_buffer);
+    close(dir_fd);
+#else
+    DIR* dir = fdopendir(dir_fd);
+    struct dirent* dent;
+
+    if (dir == NULL) { close(dir_fd); return listing; }
+    while ((dent = readdir(dir)) != NULL) {
+        dir_listing_add(listing, dent->d_name, dent->d_type);
+    }
+    closedir(dir);
+#endif
+
+    sort_names = listing->names;
+    qsort(listing->entries, listing->num_entries, sizeof(dir_entry_t), dir_entry_name_compare);
+
+    return listing;
+}
+
+void dir_listing_add(dir_listing_t* listing, const char* name, unsigned char type) {
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) { return; }
+
+    size_t name_len = strlen(name) + 1;
+    if (listing->names_len + name_len > listing->names_capacity) {
+        listing->names_capacity = listing->names_capacity == 0 ? 4096 : listing->names_capacity * 2;
+        while (listing->names_len + name_len > listing->names_capacity) { listing->names_capacity *= 2; }
+        listing->names = realloc(listing->names, listing->names_capacity);
+    }
+
+    // Entry capacity doubles at every power of two
+    if ((listing->num_entries & (listing->num_entries - 1)) == 0) {
+        size_t entries_capacity = listing->num_entries == 0 ? 1 : listing->num_entries * 2;
+        listing->entries = realloc(listing->entries, entries_capacity * sizeof(dir_entry_t));
+    }
+
+    memcpy(listing->names + listing->names_len, name, name_len);
+    listing->entries[listing->num_entries].name_offset = listing->names_len;
+    listing->entries[listing->num_entries].type = type;
+    ++listing->num_entries;
+    listing->names_len += name_len;
+}
+
+void dir_cache_clear() {
+    for (size_t i = 0; i < num_dir_cache; ++i) {
+        free(dir_cache[i]->path);
+        free(dir_cache[i]->names);
+        free(dir_cache[i]->entries);
+        free(dir_cache[i]);
+    }
+    free(dir_cache);
+    dir_cache = NULL;
+    num_dir_cache = 0;
+}
+
+
+void handle_excmd(cmd_t* cmd) {
+    
+    // To handle redirects, move the files the parent opened onto the standard streams
+    apply_redirects(cmd);
+
     // No command is found - done after redirect to handle case where a redirect might not have a command
     if (cmd->argc == 0) { 
         PRINT_ERROR;
         return;
     }
 
+    // Overrides only touch this child's copy of the variables, the shell's block is left alone
+    for (size_t i = 0; i < cmd->num_assigns; ++i) {
+        set_var(cmd->assigns[i], true);
+    }
+
+    // A name with a '/' is a path to the program itself, the search path is never consulted
+    // (the *at calls below would silently ignore their dirfd for absolute names anyway)
+    if (strchr(cmd->argv[0], '/') != NULL) {
+        if (access(cmd->argv[0], X_OK) == 0) {
+            execve(cmd->argv[0], cmd->argv, get_env_block());
+        }
+        PRINT_ERROR;
+        return;
+    }
+
+    // Lookups are relative to the search directory fds, so no path strings are built
+    // and the kernel only walks the command name itself
     bool was_found_flag = false;
     for (size_t i = 0; i < num_search_paths; ++i) {
+        if (search_path_fds[i] == -1) { continue; }
 
-        size_t bin_filepath_length = strlen(search_paths[i]) + strlen(cmd->argv[0]) + 1;
-        char* bin_filepath = malloc(bin_filepath_length * sizeof(char));
-        strlcpy(bin_filepath, search_paths[i], bin_filepath_length);
-        strlcat(bin_filepath, cmd->argv[0], bin_filepath_length);
-
-        if (access(bin_filepath, X_OK) == 0) {
-            execv(bin_filepath, cmd->argv);
+        if (faccessat(search_path_fds[i], cmd->argv[0], X_OK, 0) == 0) {
+            exec_from_search_path(i, cmd);
             was_found_flag = true;
             break;
         }
@@ -289,32 +947,103 @@ void handle_excmd(cmd_t* cmd) {
     if (!was_found_flag) {
         PRINT_ERROR;
     }
+}
 
-    dup2(saved_stdout, fileno(stdout));
-    close(saved_stdout);
+// Builtins run in the shell itself, so the streams they redirect are restored afterwards
+int handle_incmd_redirected(cmd_t* cmd) {
+    int saved_fds[3] = { -1, -1, -1 };
 
+    fflush(stdout);
+    for (size_t i = 0; i < cmd->num_redirects; ++i) {
+        int target_fd = cmd->redirects[i].target_fd;
+        if (saved_fds[target_fd] == -1) {
+            saved_fds[target_fd] = fcntl(target_fd, F_DUPFD_CLOEXEC, 3);
+        }
+    }
+    apply_redirects(cmd);
+
+    int status = handle_incmd(cmd);
+
+    fflush(stdout);
+    for (int target_fd = 0; target_fd < 3; ++target_fd) {
+        if (saved_fds[target_fd] != -1) {
+            dup2(saved_fds[target_fd], target_fd);
+            close(saved_fds[target_fd]);
+        }
+    }
+
+    return status;
+}
+
+/**
+ * Search path directories
+ *
+ * Each search directory is opened once when the path is set. Holding the directory rather
+ * than its name means renaming it (or any of its parents) doesn't break lookups, and a
+ * relative path stays anchored to the directory it named when it was set.
+ */
+void set_search_path_fds() {
+    for (size_t i = 0; search_path_fds != NULL && i < num_search_paths_fds; ++i) {
+        if (search_path_fds[i] != -1) { close(search_path_fds[i]); }
+    }
+
+    search_path_fds = realloc(search_path_fds, (num_search_paths + 1) * sizeof(int));
+    for (size_t i = 0; i < num_search_paths; ++i) {
+        search_path_fds[i] = open(search_paths[i], SEARCH_PATH_OPEN_FLAGS);
+    }
+    num_search_paths_fds = num_search_paths;
+}
+
+// Only returns if the exec failed
+void exec_from_search_path(size_t path_idx, cmd_t* cmd) {
+#ifdef __linux__
+    syscall(SYS_execveat, search_path_fds[path_idx], cmd->argv[0], cmd->argv, get_env_block(), 0);
+
+    // #! interpreters are handed "/dev/fd/N/name", which the kernel refuses with ENOENT while the
+    // directory fd is close-on-exec. Only then let the fd survive, so binaries never inherit it
+    if (errno == ENOENT) {
+        fcntl(search_path_fds[path_idx], F_SETFD, 0);
+        syscall(SYS_execveat, search_path_fds[path_idx], cmd->argv[0], cmd->argv, get_env_block(), 0);
+    }
+#else
+    char bin_filepath[PATH_MAX];
+    snprintf(bin_filepath, PATH_MAX, "%s%s", search_paths[path_idx], cmd->argv[0]);
+    execve(bin_filepath, cmd->argv, get_env_block());
+#endif
 }
 
-void handle_incmd(cmd_t* cmd) {
+int handle_incmd(cmd_t* cmd) {
+    // Assignment without a command sets shell variables
+    if (cmd->argc == 0) {
+        for (size_t i = 0; i < cmd->num_assigns; ++i) {
+            set_var(cmd->assigns[i], false);
+        }
+        return EXIT_SUCCESS;
+    }
+
     if (strcmp(cmd->argv[0], EXIT_CMD) == 0) {
         if (cmd->argc > 1) {
             PRINT_ERROR;
-            return;
+            return EXIT_FAILURE;
         }
 
+        if (is_subshell) { exit_child(EXIT_SUCCESS); }
         exit(EXIT_SUCCESS);
     }
 
     if (strcmp(cmd->argv[0], CD_CMD) == 0) {
         if (cmd->argc != 2) {
             PRINT_ERROR;
-            return;
+            return EXIT_FAILURE;
         }
 
         if (chdir(cmd->argv[1]) == -1) {
             PRINT_ERROR;
+            return EXIT_FAILURE;
         }
-        return;
+
+        dir_cache_clear(); // cached listings were keyed relative to the old directory
+        return EXIT_SUCCESS;
     }
     
     if (strcmp(cmd->argv[0], PATH_CMD) == 0) {
@@ -340,17 +1069,262 @@ void handle_incmd(cmd_t* cmd) {
             
         }
 
+        set_search_path_fds();
+        return EXIT_SUCCESS;
+    }
 
-        return;
+    if (strcmp(cmd->argv[0], EXPORT_CMD) == 0) {
+        // No arguments lists the exported environment
+        if (cmd->argc == 1) {
+            char** envp = get_env_block();
+            for (size_t i = 0; envp[i] != NULL; ++i) {
+                fputs(envp[i], stdout); fputs("\n", stdout);
+            }
+            fflush(stdout);
+            return EXIT_SUCCESS;
+        }
+
+        int status = EXIT_SUCCESS;
+        for (size_t i = 1; i < cmd->argc; ++i) {
+            if (is_assignment(cmd->argv[i])) {
+                set_var(cmd->argv[i], true);
+                continue;
+            }
+
+            // export NAME - export the current value, or an empty one if it was never set
+            size_t name_len = strlen(cmd->argv[i]);
+            char* assignment = malloc(name_len + 2);
+            const char* value = get_var(cmd->argv[i], name_len);
+
+            memcpy(assignment, cmd->argv[i], name_len);
+            assignment[name_len] = ASSIGN_TOKEN;
+            assignment[name_len + 1] = '\0';
+
+            if (!is_assignment(assignment)) {
+                PRINT_ERROR;
+                status = EXIT_FAILURE;
+                free(assignment);
+                continue;
+            }
+
+            if (value != NULL) {
+                assignment = realloc(assignment, name_len + strlen(value) + 2);
+                strcpy(assignment + name_len + 1, value);
+            }
+            set_var(assignment, true);
+            free(assignment);
+        }
+        return status;
     }
+
+    return EXIT_SUCCESS;
 }
 
 bool is_incmd(cmd_t* cmd) {
-    return strcmp(cmd->argv[0], EXIT_CMD) == 0 || 
+    return cmd->argc == 0 ||
+            strcmp(cmd->argv[0], EXIT_CMD) == 0 || 
             strcmp(cmd->argv[0], CD_CMD) == 0 || 
-            strcmp(cmd->argv[0], PATH_CMD) == 0;
+            strcmp(cmd->argv[0], PATH_CMD) == 0 ||
+            strcmp(cmd->argv[0], EXPORT_CMD) == 0;
 } 
 
+/**
+ * Variables
+ *
+ * Variables are kept as interned "NAME=value" strings so the exported ones can be used as
+ * envp entries directly. The envp block is cached and only rebuilt after an exported
+ * variable actually changes, setting a variable to its current value is a pointer compare.
+ * Interned strings are reference counted, so old values are freed once no variable holds them.
+ */
+// FNV-1a
+uint64_t hash_string(const char* string, size_t len) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; ++i) {
+        hash = (hash ^ (unsigned char) string[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Returns the interned copy of string and takes a reference on it
+const char* intern_string(const char* string, size_t len) {
+    if (intern_count >= intern_capacity) {
+        size_t old_capacity = intern_capacity;
+        intern_entry_t** old_table = intern_table;
+
+        intern_capacity = old_capacity == 0 ? INTERN_INITIAL_CAPACITY : old_capacity * 2;
+        intern_table = calloc(intern_capacity, sizeof(intern_entry_t*));
+
+        for (size_t i = 0; i < old_capacity; ++i) {
+            intern_entry_t* entry = old_table[i];
+            while (entry != NULL) {
+                intern_entry_t* next = entry->next;
+                size_t slot = hash_string(entry->string, strlen(entry->string)) & (intern_capacity - 1);
+
+                entry->next = intern_table[slot];
+                intern_table[slot] = entry;
+                entry = next;
+            }
+        }
+        free(old_table);
+    }
+
+    size_t slot = hash_string(string, len) & (intern_capacity - 1);
+    for (intern_entry_t* entry = intern_table[slot]; entry != NULL; entry = entry->next) {
+        if (strncmp(entry->string, string, len) == 0 && entry->string[len] == '\0') {
+            ++entry->refs;
+            return entry->string;
+        }
+    }
+
+    intern_entry_t* entry = malloc(sizeof(intern_entry_t) + len + 1);
+    memcpy(entry->string, string, len);
+    entry->string[len] = '\0';
+    entry->refs = 1;
+    entry->next = intern_table[slot];
+    intern_table[slot] = entry;
+    ++intern_count;
+
+    return entry->string;
+}
+
+// Drops a reference taken by intern_string, the string is freed once nothing holds it
+void release_string(const char* string) {
+    intern_entry_t* released = (intern_entry_t*) (string - offsetof(intern_entry_t, string));
+    if (--released->refs > 0) { return; }
+
+    intern_entry_t** link = &intern_table[hash_string(string, strlen(string)) & (intern_capacity - 1)];
+    while (*link != released) { link = &(*link)->next; }
+
+    *link = released->next;
+    free(released);
+    --intern_count;
+}
+
+// Everything inherited from the parent process starts out exported
+void load_environment(char** envp) {
+    for (size_t i = 0; envp != NULL && envp[i] != NULL; ++i) {
+        if (strchr(envp[i], ASSIGN_TOKEN) != NULL) {
+            set_var(envp[i], true);
+        }
+    }
+}
+
+var_t* find_var(const char* name, size_t name_len) {
+    for (size_t i = 0; i < num_shell_vars; ++i) {
+        if (shell_vars[i].name_len == name_len && strncmp(shell_vars[i].entry, name, name_len) == 0) {
+            return &shell_vars[i];
+        }
+    }
+    return NULL;
+}
+
+const char* get_var(const char* name, size_t name_len) {
+    var_t* var = find_var(name, name_len);
+    return var == NULL ? NULL : var->entry + name_len + 1;
+}
+
+// assignment is "NAME=value", export only ever adds the export flag, it never clears it
+void set_var(const char* assignment, bool export) {
+    size_t name_len = strchr(assignment, ASSIGN_TOKEN) - assignment;
+    const char* entry = intern_string(assignment, strlen(assignment));
+    var_t* var = find_var(assignment, name_len);
+
+    if (var == NULL) {
+        shell_vars = realloc(shell_vars, (num_shell_vars + 1) * sizeof(var_t));
+        var = &shell_vars[num_shell_vars++];
+        var->entry = NULL;
+        var->name_len = name_len;
+        var->exported = false;
+    }
+
+    // The variable keeps a single reference however often it is set to the same value
+    if (var->entry == entry) {
+        release_string(entry);
+        if (var->exported || !export) { return; }
+    } else if (var->entry != NULL) {
+        release_string(var->entry);
+    }
+
+    var->entry = entry;
+    var->exported = var->exported || export;
+    if (var->exported) { env_block_dirty = true; }
+}
+
+char** get_env_block() {
+    if (!env_block_dirty) { return env_block; }
+
+    env_block = realloc(env_block, (num_shell_vars + 1) * sizeof(char*));
+    size_t num_exported = 0;
+    for (size_t i = 0; i < num_shell_vars; ++i) {
+        if (shell_vars[i].exported) {
+            env_block[num_exported++] = (char*) shell_vars[i].entry;
+        }
+    }
+    env_block[num_exported] = NULL;
+
+    env_block_dirty = false;
+    return env_block;
+}
+
+bool is_assignment(const char* token) {
+    if (!(isalpha((unsigned char) token[0]) || token[0] == '_')) { return false; }
+
+    size_t i = 1;
+    while (isalnum((unsigned char) token[i]) || token[i] == '_') { ++i; }
+    return token[i] == ASSIGN_TOKEN;
+}
+
+// Replace $NAME and ${NAME} with the variable's value, unset variables expand to nothing
+char* expand_vars(const char* token) {
+    if (strchr(token, VAR_TOKEN) == NULL) { return strdup(token); }
+
+    size_t expanded_capacity = strlen(token) + 1, expanded_len = 0;
+    char* expanded = malloc(expanded_capacity);
+
+    for (size_t i = 0; token[i] != '\0';) {
+        const char* value = NULL;
+        size_t value_len = 1, consumed = 1;
+        char status_buffer[16];
+
+        if (token[i] == VAR_TOKEN) {
+            bool is_braced = token[i + 1] == '{';
+            size_t name_start = i + 1 + is_braced, name_end = name_start;
+
+            if (isalpha((unsigned char) token[name_start]) || token[name_start] == '_') {
+                while (isalnum((unsigned char) token[name_end]) || token[name_end] == '_') { ++name_end; }
+            }
+
+            // Anything that isn't a valid reference stays a literal '$'
+            if (token[name_start] == STATUS_VAR_TOKEN && (!is_braced || token[name_start + 1] == '}')) {
+                snprintf(status_buffer, sizeof(status_buffer), "%d", last_status);
+                value = status_buffer;
+                value_len = strlen(value);
+                consumed = name_start + 1 - i + is_braced;
+            } else if (name_end > name_start && (!is_braced || token[name_end] == '}')) {
+                value = get_var(token + name_start, name_end - name_start);
+                if (value == NULL) { value = ""; }
+                value_len = strlen(value);
+                consumed = name_end - i + is_braced;
+            }
+        }
+
+        if (value == NULL) {
+            value = token + i;
+        }
+
+        if (expanded_len + value_len + 1 > expanded_capacity) {
+            while (expanded_len + value_len + 1 > expanded_capacity) { expanded_capacity *= 2; }
+            expanded = realloc(expanded, expanded_capacity);
+        }
+        memcpy(expanded + expanded_len, value, value_len);
+        expanded_len += value_len;
+        i += consumed;
+    }
+
+    expanded[expanded_len] = '\0';
+    return expanded;
+}
+
 // https://stackoverflow.com/questions/17770202/remove-extra-whitespace-from-a-string-in-c
 void strip_extra_spaces(char* string) {
   size_t i, x;